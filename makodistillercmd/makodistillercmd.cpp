@@ -16,12 +16,57 @@
 #define WANT_STD_FILESYSTEM 0
 #endif
 
+// Compressed input files (.gz, .zst, .bz2) are detected by their magic
+// bytes and decompressed on the fly.  zlib and zstd are pulled in by the
+// project; bzip2 needs its library adding to the project before it can be
+// enabled here.  An input in a disabled format is reported as an error.
+#define WANT_ZLIB 1
+#define WANT_ZSTD 1
+
+#ifndef WANT_ZLIB
+#define WANT_ZLIB 0
+#endif
+
+#ifndef WANT_ZSTD
+#define WANT_ZSTD 0
+#endif
+
+#ifndef WANT_BZIP2
+#define WANT_BZIP2 0
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
 #include <exception>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include <filesystem>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#if WANT_ZLIB
+#include <zlib.h>
+#endif
+#if WANT_ZSTD
+#include <zstd.h>
+#endif
+#if WANT_BZIP2
+#include <bzlib.h>
+#endif
 #include <jawsmako/jawsmako.h>
 #include <jawsmako/distiller.h>
+#include <jawsmako/pdfoptimize.h>
 
 using namespace JawsMako;
 using namespace EDL;
@@ -34,6 +79,37 @@ typedef std::pair<U8String, U8String> DistillerParam;
 typedef std::vector<DistillerParam> DistillerParams;
 typedef std::map<U8String, DistillerParam> ParamMap;
 
+enum eCompressionType
+{
+    eCTNone,
+    eCTGzip,
+    eCTZstd,
+    eCTBzip2
+};
+
+// Size of the ring buffer between the decompression thread and the
+// interpreter, and of the chunks read from the compressed file.
+#define DECOMPRESS_BUFFER_SIZE (4 * 1024 * 1024)
+#define COMPRESSED_CHUNK_SIZE (256 * 1024)
+
+// The journal is synced to disk once this many jobs are pending, or this
+// many seconds after the first pending one, whichever comes first.
+#define JOURNAL_GROUP_SIZE 64
+#define JOURNAL_GROUP_SECONDS 2
+
+// Size of the chunks read when hashing an output file.
+#define HASH_CHUNK_SIZE (256 * 1024)
+
+#ifdef _WIN32
+typedef std::wstring ArgString;
+#define RESUME_OPTION L"--resume"
+#define JOURNAL_SUFFIX L".journal"
+#else
+typedef std::string ArgString;
+#define RESUME_OPTION "--resume"
+#define JOURNAL_SUFFIX ".journal"
+#endif
+
 static void usage()
 {
     std::wcout << L"================================================================" << std::endl;
@@ -41,7 +117,12 @@ static void usage()
     std::wcout << L"All Rights Reserved." << std::endl;
     std::wcout << L"================================================================" << std::endl;
     std::wcout << std::endl;
-    std::wcout << L"Usage: makodistillercmd <arg_file>" << std::endl;
+    std::wcout << L"Usage: makodistillercmd [--resume] <arg_file>" << std::endl;
+    std::wcout << std::endl;
+    std::wcout << L"  Each completed job is recorded in <arg_file>.journal.  With --resume," << std::endl;
+    std::wcout << L"  jobs already recorded there are skipped if their input, options and" << std::endl;
+    std::wcout << L"  output are unchanged.  Without --resume any existing journal is" << std::endl;
+    std::wcout << L"  overwritten, and if it cannot be written the jobs are run without one." << std::endl;
     std::wcout << std::endl;
     std::wcout << L"Options" << std::endl;
     std::wcout << L"-------" << std::endl;
@@ -63,6 +144,9 @@ static void usage()
     std::wcout << L"  -dz          : Flate/Zip compress text" << std::endl;
     std::wcout << L"  -dZ<option>  : PDF1.5 object compression; option can be None, Tags or All" << std::endl;
     std::wcout << L"                 -dZ is equivalent to -dZAll; no -dZ means -dZNone" << std::endl;
+    std::wcout << L"  -dO          : optimise the distilled PDF; identical images, fonts and" << std::endl;
+    std::wcout << L"                 forms are shared across pages, object streams are rebuilt" << std::endl;
+    std::wcout << L"                 as set by -dZ and the file is linearised for fast web view" << std::endl;
     std::wcout << std::endl;
     std::wcout << L" Distill (PDF output) mode image options:" << std::endl;
     std::wcout << L"  -dc*         : colour image options" << std::endl;
@@ -126,6 +210,9 @@ static void usage()
     std::wcout << std::endl;
     std::wcout << L"  -h or -?     : this usage information" << std::endl;
     std::wcout << std::endl;
+    std::wcout << L" Input files compressed with gzip or zstd are detected automatically" << std::endl;
+    std::wcout << L" and decompressed while they are being distilled." << std::endl;
+    std::wcout << std::endl;
     std::wcout << std::endl;
     std::wcout << L"Example:" << std::endl;
     std::wcout << L"--------" << std::endl;
@@ -168,6 +255,1017 @@ static void setDistillerParameters(IDistillerPtr &distiller, DistillerParams &pa
     }
 }
 
+// A bounded single producer, single consumer byte queue.  The writer
+// blocks while the buffer is full and the reader blocks while it is empty,
+// so decompression runs at most one buffer ahead of the interpreter.
+class RingBuffer
+{
+public:
+    RingBuffer(size_t capacity) :
+        m_buffer(capacity), m_head(0), m_size(0), m_finished(false), m_cancelled(false)
+    {
+    }
+
+    // Returns false if the reader has gone away.
+    bool write(const uint8 *data, size_t len)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (len > 0)
+        {
+            m_notFull.wait(lock, [this] { return m_cancelled || m_size < m_buffer.size(); });
+            if (m_cancelled)
+            {
+                return false;
+            }
+
+            size_t tail = (m_head + m_size) % m_buffer.size();
+            size_t count = std::min(len, std::min(m_buffer.size() - m_size, m_buffer.size() - tail));
+            memcpy(&m_buffer[tail], data, count);
+            m_size += count;
+            data += count;
+            len -= count;
+            m_notEmpty.notify_one();
+        }
+        return true;
+    }
+
+    // Returns 0 once the writer has finished and the buffer is drained.
+    size_t read(uint8 *data, size_t len)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [this] { return m_finished || m_size > 0; });
+
+        size_t count = std::min(len, std::min(m_size, m_buffer.size() - m_head));
+        memcpy(data, &m_buffer[m_head], count);
+        m_head = (m_head + count) % m_buffer.size();
+        m_size -= count;
+        m_notFull.notify_one();
+        return count;
+    }
+
+    // Called by the writer when there is no more data.
+    void finish(const U8String &error = U8String())
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finished = true;
+        m_error = error;
+        m_notEmpty.notify_all();
+    }
+
+    // Called by the reader to release a blocked writer.
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled = true;
+        m_notFull.notify_all();
+    }
+
+    U8String error()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_error;
+    }
+
+private:
+    std::vector<uint8>      m_buffer;
+    size_t                  m_head;
+    size_t                  m_size;
+    bool                    m_finished;
+    bool                    m_cancelled;
+    U8String                m_error;
+    std::mutex              m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+};
+
+// Open a UTF-8 path for binary reading.  Narrow paths are taken to be in
+// the ANSI code page on Windows, so go through std::filesystem if we can.
+static void openForReading(std::ifstream &file, const U8String &filePath)
+{
+#if WANT_STD_FILESYSTEM
+    file.open(fs::u8path(filePath), std::ios::binary);
+#else
+    file.open(filePath, std::ios::binary);
+#endif
+}
+
+static eCompressionType detectCompression(const U8String &filePath)
+{
+    std::ifstream file;
+    openForReading(file, filePath);
+    uint8 magic[4] = { 0 };
+    file.read((char *) magic, sizeof(magic));
+
+    if (magic[0] == 0x1f && magic[1] == 0x8b)
+    {
+        return eCTGzip;
+    }
+    if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    {
+        return eCTZstd;
+    }
+    if (magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h')
+    {
+        return eCTBzip2;
+    }
+    return eCTNone;
+}
+
+static bool compressionSupported(eCompressionType compression)
+{
+    switch (compression)
+    {
+        case eCTGzip:
+            return WANT_ZLIB != 0;
+
+        case eCTZstd:
+            return WANT_ZSTD != 0;
+
+        case eCTBzip2:
+            return WANT_BZIP2 != 0;
+
+        default:
+            return true;
+    }
+}
+
+// Decompress the whole of file into ring.  Runs on the decompression
+// thread; returns an error description, or an empty string on success.
+// Concatenated members/frames are all decompressed, as the command line
+// tools do.
+static U8String decompressToRing(std::ifstream &file, eCompressionType compression, RingBuffer &ring)
+{
+    std::vector<uint8> in(COMPRESSED_CHUNK_SIZE);
+    std::vector<uint8> out(COMPRESSED_CHUNK_SIZE);
+
+    switch (compression)
+    {
+#if WANT_ZLIB
+        case eCTGzip:
+        {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+            {
+                return "gzip initialisation failed";
+            }
+
+            U8String error;
+            bool stop = false;
+            bool complete = false;
+            bool memberStart = true;
+            while (!stop && (file.read((char *) in.data(), in.size()), file.gcount() > 0))
+            {
+                zs.next_in = in.data();
+                zs.avail_in = (uInt) file.gcount();
+
+                // Keep going while output is produced, as the decompressor
+                // may hold back output after consuming all of its input.
+                do
+                {
+                    if (complete && memberStart && zs.avail_in > 0 &&
+                        (zs.next_in[0] != 0x1f || (zs.avail_in > 1 && zs.next_in[1] != 0x8b)))
+                    {
+                        // Not another member, such as the zero padding of
+                        // a block archive; gzip ignores it, and so do we.
+                        stop = true;
+                        break;
+                    }
+
+                    uInt availIn = zs.avail_in;
+                    zs.next_out = out.data();
+                    zs.avail_out = (uInt) out.size();
+                    int ret = inflate(&zs, Z_NO_FLUSH);
+                    if (ret == Z_STREAM_END || zs.avail_in != availIn)
+                    {
+                        complete = ret == Z_STREAM_END;
+                        memberStart = false;
+                    }
+                    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                    {
+                        error = "gzip data is corrupt";
+                        stop = true;
+                    }
+                    else if (!ring.write(out.data(), out.size() - zs.avail_out))
+                    {
+                        stop = true;
+                    }
+                    else if (ret == Z_STREAM_END)
+                    {
+                        // Another member may follow.
+                        inflateReset(&zs);
+                        memberStart = true;
+                    }
+                }
+                while (!stop && (zs.avail_in > 0 || zs.avail_out < out.size()));
+            }
+            if (!stop && !complete)
+            {
+                error = "gzip data is truncated";
+            }
+            inflateEnd(&zs);
+            return error;
+        }
+#endif
+
+#if WANT_ZSTD
+        case eCTZstd:
+        {
+            ZSTD_DStream *zds = ZSTD_createDStream();
+            if (!zds)
+            {
+                return "zstd initialisation failed";
+            }
+            ZSTD_initDStream(zds);
+
+            U8String error;
+            bool stop = false;
+            size_t hint = 0;
+            while (!stop && (file.read((char *) in.data(), in.size()), file.gcount() > 0))
+            {
+                ZSTD_inBuffer input = { in.data(), (size_t) file.gcount(), 0 };
+                ZSTD_outBuffer output;
+
+                // Keep going while there is input, or while the output
+                // buffer is filled, as more may then be held back.
+                do
+                {
+                    size_t inputPos = input.pos;
+                    output = { out.data(), out.size(), 0 };
+                    size_t ret = ZSTD_decompressStream(zds, &output, &input);
+                    if (ZSTD_isError(ret))
+                    {
+                        error = ZSTD_getErrorName(ret);
+                        stop = true;
+                    }
+                    else
+                    {
+                        // A call with no input or output may begin a new frame
+                        // and report its header size, so ignore its hint.
+                        if (input.pos != inputPos || output.pos > 0)
+                        {
+                            hint = ret;
+                        }
+                        if (!ring.write(out.data(), output.pos))
+                        {
+                            stop = true;
+                        }
+                    }
+                }
+                while (!stop && (input.pos < input.size || output.pos == output.size));
+            }
+            if (!stop && hint != 0)
+            {
+                // A non-zero hint means the last frame is incomplete.
+                error = "zstd data is truncated";
+            }
+            ZSTD_freeDStream(zds);
+            return error;
+        }
+#endif
+
+#if WANT_BZIP2
+        case eCTBzip2:
+        {
+            bz_stream bzs;
+            memset(&bzs, 0, sizeof(bzs));
+            if (BZ2_bzDecompressInit(&bzs, 0, 0) != BZ_OK)
+            {
+                return "bzip2 initialisation failed";
+            }
+
+            U8String error;
+            bool stop = false;
+            bool complete = false;
+            bool streamStart = true;
+            while (!stop && (file.read((char *) in.data(), in.size()), file.gcount() > 0))
+            {
+                bzs.next_in = (char *) in.data();
+                bzs.avail_in = (unsigned int) file.gcount();
+
+                // Keep going while output is produced; bzip2 only reports the
+                // end of a stream on a call after its last output.
+                do
+                {
+                    if (complete && streamStart && bzs.avail_in > 0 &&
+                        (bzs.next_in[0] != 'B' || (bzs.avail_in > 1 && bzs.next_in[1] != 'Z')))
+                    {
+                        // Not another stream, such as the zero padding of
+                        // a block archive; bzip2 ignores it, and so do we.
+                        stop = true;
+                        break;
+                    }
+
+                    unsigned int availIn = bzs.avail_in;
+                    bzs.next_out = (char *) out.data();
+                    bzs.avail_out = (unsigned int) out.size();
+                    int ret = BZ2_bzDecompress(&bzs);
+                    if (complete && streamStart && ret == BZ_DATA_ERROR_MAGIC)
+                    {
+                        // Trailing data that only looked like another stream.
+                        stop = true;
+                        break;
+                    }
+                    if (ret == BZ_STREAM_END || bzs.avail_in != availIn)
+                    {
+                        complete = ret == BZ_STREAM_END;
+                        streamStart = false;
+                    }
+                    if (ret != BZ_OK && ret != BZ_STREAM_END)
+                    {
+                        error = "bzip2 data is corrupt";
+                        stop = true;
+                    }
+                    else if (!ring.write(out.data(), out.size() - bzs.avail_out))
+                    {
+                        stop = true;
+                    }
+                    else if (ret == BZ_STREAM_END)
+                    {
+                        // Another stream may follow.
+                        char *nextIn = bzs.next_in;
+                        unsigned int remainingIn = bzs.avail_in;
+                        BZ2_bzDecompressEnd(&bzs);
+                        memset(&bzs, 0, sizeof(bzs));
+                        bzs.next_in = nextIn;
+                        bzs.avail_in = remainingIn;
+                        if (BZ2_bzDecompressInit(&bzs, 0, 0) != BZ_OK)
+                        {
+                            return "bzip2 initialisation failed";
+                        }
+                        streamStart = true;
+                    }
+                }
+                while (!stop && (bzs.avail_in > 0 || bzs.avail_out < out.size()));
+            }
+            if (!stop && !complete)
+            {
+                error = "bzip2 data is truncated";
+            }
+            BZ2_bzDecompressEnd(&bzs);
+            return error;
+        }
+#endif
+
+        default:
+            return "unsupported compression";
+    }
+}
+
+// An IInputStream that reads a compressed file.  Decompression runs on a
+// background thread and feeds a bounded ring buffer, so it overlaps with
+// interpretation and nothing is written to disk.
+class DecompressingInputStream : public IRCObjectImpl<IInputStream>
+{
+public:
+    DecompressingInputStream(const U8String &filePath, eCompressionType compression) :
+        m_filePath(filePath), m_compression(compression), m_ring(DECOMPRESS_BUFFER_SIZE), m_opened(false)
+    {
+    }
+
+    virtual ~DecompressingInputStream()
+    {
+        close();
+    }
+
+    virtual bool open()
+    {
+        if (m_opened)
+        {
+            // Not seekable; the stream can only be read once.
+            return false;
+        }
+
+        openForReading(m_file, m_filePath);
+        if (!m_file.is_open())
+        {
+            return false;
+        }
+        m_opened = true;
+
+        m_thread = std::thread([this]
+        {
+            m_ring.finish(decompressToRing(m_file, m_compression, m_ring));
+        });
+        return true;
+    }
+
+    virtual void close()
+    {
+        if (m_thread.joinable())
+        {
+            m_ring.cancel();
+            m_thread.join();
+        }
+        m_file.close();
+    }
+
+    virtual int32 read(void *buffer, int32 bufferSize)
+    {
+        uint8 *out = (uint8 *) buffer;
+        size_t total = 0;
+        while (total < (size_t) bufferSize)
+        {
+            size_t count = m_ring.read(out + total, bufferSize - total);
+            if (count == 0)
+            {
+                break;
+            }
+            total += count;
+        }
+
+        if (total == 0)
+        {
+            U8String error = m_ring.error();
+            if (error.length() != 0)
+            {
+                std::cerr << "Error decompressing " << m_filePath << " : " << error << std::endl;
+                return -1;
+            }
+        }
+        return (int32) total;
+    }
+
+private:
+    U8String          m_filePath;
+    eCompressionType  m_compression;
+    std::ifstream     m_file;
+    RingBuffer        m_ring;
+    std::thread       m_thread;
+    bool              m_opened;
+};
+
+// Create the input stream for a job, decompressing on the fly if the
+// file is compressed.
+static IInputStreamPtr createInputStream(const IJawsMakoPtr &jawsMako, const U8String &inputFilePath)
+{
+    eCompressionType compression = detectCompression(inputFilePath);
+    if (compression == eCTNone)
+    {
+        return IInputStream::createFromFile(jawsMako, inputFilePath);
+    }
+
+    if (!compressionSupported(compression))
+    {
+        throw std::runtime_error("Compressed input not supported by this build: " + inputFilePath);
+    }
+    return IInputStreamPtr(new DecompressingInputStream(inputFilePath, compression), true);
+}
+
+// Remove a file, ignoring any error.
+static void removeFile(const U8String &filePath)
+{
+#if WANT_STD_FILESYSTEM
+    std::error_code err;
+    fs::remove(fs::u8path(filePath), err);
+#else
+    std::remove(filePath.c_str());
+#endif
+}
+
+// Rewrite a distilled PDF in place using the Mako optimiser. Streams are
+// hashed so that images, fonts and forms re-emitted by the PostScript on
+// each page are written once and shared, and the result is linearised for
+// fast web view.  Object streams are rebuilt as chosen with -dZ, which is
+// passed as objectCompression ("none", "tags" or "all").
+static void optimizePdf(const IJawsMakoPtr &jawsMako, const U8String &pdfFilePath, const U8String &objectCompression, const IProgressMonitorPtr &progressMonitor)
+{
+    U8String tempFilePath = pdfFilePath + ".opt";
+
+    DistillerParams optimizerParams;
+    optimizerParams.push_back(DistillerParam("deduplicateimages", "true"));
+    optimizerParams.push_back(DistillerParam("deduplicatefonts", "true"));
+    optimizerParams.push_back(DistillerParam("deduplicateforms", "true"));
+    optimizerParams.push_back(DistillerParam("objectcompression", objectCompression));
+    optimizerParams.push_back(DistillerParam("linearize", "true"));
+
+    IPDFOptimizerPtr optimizer = IPDFOptimizer::create(jawsMako);
+    for (size_t i = 0; i < optimizerParams.size(); i++)
+    {
+        if (!optimizer->setParameter(optimizerParams[i].first, optimizerParams[i].second))
+        {
+            throw std::runtime_error("Optimizer rejected parameter " + optimizerParams[i].first + "=" + optimizerParams[i].second);
+        }
+    }
+
+    std::cout << "Optimizing " << pdfFilePath << std::endl;
+
+    // Optimize to a temporary file, leaving the distilled PDF untouched
+    // until the optimized one is complete.
+    bool optimized = false;
+    try
+    {
+        optimized = optimizer->optimize(IInputStream::createFromFile(jawsMako, pdfFilePath), IOutputStream::createToFile(jawsMako, tempFilePath), progressMonitor);
+    }
+    catch (...)
+    {
+        removeFile(tempFilePath);
+        throw;
+    }
+
+#if WANT_STD_FILESYSTEM
+    std::error_code err;
+    if (!optimized || fs::file_size(fs::u8path(tempFilePath), err) == 0 || err)
+    {
+        removeFile(tempFilePath);
+        throw std::runtime_error("Failed to optimize " + pdfFilePath);
+    }
+
+    // Replace the distilled file with the optimized one.  The target is
+    // replaced in one step, so the distilled file survives a failure.
+    fs::rename(fs::u8path(tempFilePath), fs::u8path(pdfFilePath), err);
+    if (err)
+    {
+        removeFile(tempFilePath);
+        throw std::runtime_error("Failed to replace " + pdfFilePath + " with the optimized file");
+    }
+#else
+    if (!optimized)
+    {
+        removeFile(tempFilePath);
+        throw std::runtime_error("Failed to optimize " + pdfFilePath);
+    }
+
+    // Replace the distilled file with the optimized one.  std::rename may
+    // not replace an existing file, so move the distilled file aside first
+    // and put it back if the optimized one cannot take its place.
+    U8String backupFilePath = pdfFilePath + ".bak";
+    if (std::rename(pdfFilePath.c_str(), backupFilePath.c_str()) != 0)
+    {
+        removeFile(tempFilePath);
+        throw std::runtime_error("Failed to replace " + pdfFilePath + " with the optimized file");
+    }
+    if (std::rename(tempFilePath.c_str(), pdfFilePath.c_str()) != 0)
+    {
+        removeFile(tempFilePath);
+        if (std::rename(backupFilePath.c_str(), pdfFilePath.c_str()) != 0)
+        {
+            throw std::runtime_error("Failed to replace " + pdfFilePath + " with the optimized file; the distilled file is left as " + backupFilePath);
+        }
+        throw std::runtime_error("Failed to replace " + pdfFilePath + " with the optimized file");
+    }
+    std::remove(backupFilePath.c_str());
+#endif
+}
+
+// 64-bit FNV-1a, used to fingerprint job inputs, options and outputs.
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+static uint64 hashBytes(const void *data, size_t len, uint64 hash = HASH_SEED)
+{
+    const uint8 *bytes = (const uint8 *) data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Get the size and modification time of a file.  Returns false if it
+// does not exist.
+static bool getFileInfo(const U8String &filePath, uint64 &size, int64 &modified)
+{
+#if WANT_STD_FILESYSTEM
+    std::error_code err;
+    fs::path p = fs::u8path(filePath);
+    size = (uint64) fs::file_size(p, err);
+    if (err)
+    {
+        return false;
+    }
+    modified = (int64) fs::last_write_time(p, err).time_since_epoch().count();
+    return !err;
+#else
+    struct stat info;
+    if (stat(filePath.c_str(), &info) != 0)
+    {
+        return false;
+    }
+    size = (uint64) info.st_size;
+    modified = (int64) info.st_mtime;
+    return true;
+#endif
+}
+
+// Hash the contents of a file.  Returns false if it cannot be read.
+static bool hashFile(const U8String &filePath, uint64 &hash)
+{
+    std::ifstream file;
+    openForReading(file, filePath);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    std::vector<char> buffer(HASH_CHUNK_SIZE);
+    hash = HASH_SEED;
+    while (file.read(buffer.data(), buffer.size()), file.gcount() > 0)
+    {
+        hash = hashBytes(buffer.data(), (size_t) file.gcount(), hash);
+    }
+    return !file.bad();
+}
+
+// Sync a file, and on POSIX the directory entry naming it, to disk.
+// Returns false if either cannot be synced.
+static bool syncToDisk(const U8String &filePath)
+{
+#ifdef _WIN32
+#if WANT_STD_FILESYSTEM
+    int fd = _wopen(fs::u8path(filePath).c_str(), _O_RDWR | _O_BINARY);
+#else
+    int fd = _open(filePath.c_str(), _O_RDWR | _O_BINARY);
+#endif
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool synced = _commit(fd) == 0;
+    _close(fd);
+    return synced;
+#else
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    if (!synced)
+    {
+        return false;
+    }
+
+    // The file may just have been renamed into place by the optimiser.
+    size_t pos = filePath.find_last_of('/');
+    U8String dirPath = pos == U8String::npos ? U8String(".") : pos == 0 ? U8String("/") : filePath.substr(0, pos);
+    fd = open(dirPath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+#endif
+}
+
+// An IInputStream that hashes the data read through it, so a job's input
+// is fingerprinted as it is distilled rather than read a second time.
+// Anything left unread when the stream is closed is read and hashed then.
+class HashingInputStream : public IRCObjectImpl<IInputStream>
+{
+public:
+    HashingInputStream(const IInputStreamPtr &stream) :
+        m_stream(stream), m_hash(HASH_SEED), m_opened(false), m_complete(false), m_failed(false)
+    {
+    }
+
+    virtual ~HashingInputStream()
+    {
+        // No need to hash the rest if the job failed.
+        if (m_opened)
+        {
+            m_stream->close();
+        }
+    }
+
+    virtual bool open()
+    {
+        m_hash = HASH_SEED;
+        m_complete = false;
+        m_failed = false;
+        m_opened = m_stream->open();
+        return m_opened;
+    }
+
+    virtual void close()
+    {
+        if (m_opened)
+        {
+            uint8 buffer[4096];
+            while (!m_complete && !m_failed)
+            {
+                read(buffer, sizeof(buffer));
+            }
+            m_stream->close();
+            m_opened = false;
+        }
+    }
+
+    virtual int32 read(void *buffer, int32 bufferSize)
+    {
+        int32 count = m_stream->read(buffer, bufferSize);
+        if (count > 0)
+        {
+            m_hash = hashBytes(buffer, (size_t) count, m_hash);
+        }
+        else if (count == 0)
+        {
+            m_complete = true;
+        }
+        else
+        {
+            m_failed = true;
+        }
+        return count;
+    }
+
+    // Get the hash of all the data, reading any that remains.  Returns
+    // false if the stream could not be read to the end.
+    bool getHash(uint64 &hash)
+    {
+        close();
+        hash = m_hash;
+        return m_complete && !m_failed;
+    }
+
+private:
+    IInputStreamPtr m_stream;
+    uint64          m_hash;
+    bool            m_opened;
+    bool            m_complete;
+    bool            m_failed;
+};
+
+// An append-only record of completed jobs, so that an interrupted batch
+// can be resumed.  Each line holds, tab separated, the input hash, size
+// and modification time, the hash of the options in effect, the output
+// hash, size and modification time, the output path and the input path.
+// Lines are synced to disk in groups by a background thread; after a
+// crash at most the last unsynced group of jobs is redone, and a torn
+// final line is ignored.
+class JobJournal
+{
+public:
+    struct Entry
+    {
+        uint64 inputHash;
+        uint64 inputSize;
+        int64  inputModified;
+        uint64 optionsHash;
+        uint64 outputHash;
+        uint64 outputSize;
+        int64  outputModified;
+    };
+
+    JobJournal() :
+        m_file(NULL), m_pending(0), m_tornLine(false), m_closing(false)
+    {
+    }
+
+    ~JobJournal()
+    {
+        close();
+    }
+
+    // Open the journal.  When resuming, the existing entries are loaded
+    // and new ones appended; otherwise the journal is truncated.
+    bool open(const ArgString &journalPath, bool resume)
+    {
+        if (resume)
+        {
+            load(journalPath);
+        }
+
+#ifdef _WIN32
+        m_file = _wfopen(journalPath.c_str(), resume ? L"ab" : L"wb");
+#else
+        m_file = fopen(journalPath.c_str(), resume ? "ab" : "wb");
+#endif
+        if (!m_file)
+        {
+            return false;
+        }
+
+        if (resume && m_tornLine)
+        {
+            // Terminate a line torn by a crash so the next entry is intact.
+            fputc('\n', m_file);
+        }
+
+        m_closing = false;
+        m_syncThread = std::thread([this] { syncLoop(); });
+        return true;
+    }
+
+    void close()
+    {
+        if (m_syncThread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_closing = true;
+            }
+            m_wake.notify_one();
+            m_syncThread.join();
+        }
+
+        if (m_file)
+        {
+            sync();
+            fclose(m_file);
+            m_file = NULL;
+        }
+    }
+
+    // Find the entry for a job completed by an earlier run.
+    const Entry *find(const U8String &inputPath, const U8String &outputPath) const
+    {
+        std::map<JobKey, Entry>::const_iterator iter = m_done.find(JobKey(inputPath, outputPath));
+        return iter == m_done.end() ? NULL : &iter->second;
+    }
+
+    // Record a completed job, syncing if the current group is full.
+    void record(const U8String &inputPath, const U8String &outputPath, const Entry &entry)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_file)
+        {
+            return;
+        }
+
+        fprintf(m_file, "%016llx\t%llu\t%lld\t%016llx\t%016llx\t%llu\t%lld\t%s\t%s\n",
+                (unsigned long long) entry.inputHash, (unsigned long long) entry.inputSize,
+                (long long) entry.inputModified,
+                (unsigned long long) entry.optionsHash,
+                (unsigned long long) entry.outputHash, (unsigned long long) entry.outputSize,
+                (long long) entry.outputModified,
+                outputPath.c_str(), inputPath.c_str());
+
+        if (m_pending++ == 0)
+        {
+            m_groupStart = std::chrono::steady_clock::now();
+            m_wake.notify_one();
+        }
+        if (m_pending >= JOURNAL_GROUP_SIZE)
+        {
+            syncLocked();
+        }
+    }
+
+    size_t doneCount() const
+    {
+        return m_done.size();
+    }
+
+private:
+    typedef std::pair<U8String, U8String> JobKey;
+
+    // Flush and sync any pending entries.
+    void sync()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        syncLocked();
+    }
+
+    void syncLocked()
+    {
+        if (!m_file || m_pending == 0)
+        {
+            return;
+        }
+
+        fflush(m_file);
+#ifdef _WIN32
+        _commit(_fileno(m_file));
+#else
+        fsync(fileno(m_file));
+#endif
+        m_pending = 0;
+    }
+
+    // Sync a pending group once it is old enough, even if no further job
+    // completes in the meantime.
+    void syncLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_closing)
+        {
+            if (m_pending == 0)
+            {
+                m_wake.wait(lock);
+                continue;
+            }
+
+            std::chrono::steady_clock::time_point deadline = m_groupStart + std::chrono::seconds(JOURNAL_GROUP_SECONDS);
+            if (m_wake.wait_until(lock, deadline) == std::cv_status::timeout &&
+                m_pending > 0 && std::chrono::steady_clock::now() >= m_groupStart + std::chrono::seconds(JOURNAL_GROUP_SECONDS))
+            {
+                syncLocked();
+            }
+        }
+    }
+
+    void load(const ArgString &journalPath)
+    {
+        m_tornLine = false;
+
+#if WANT_STD_FILESYSTEM
+        std::ifstream file(fs::path(journalPath), std::ios::binary);
+#else
+        std::ifstream file(journalPath, std::ios::binary);
+#endif
+        U8String line;
+        while (std::getline(file, line))
+        {
+            if (file.eof())
+            {
+                // No newline, so the line was torn by a crash.
+                m_tornLine = true;
+                break;
+            }
+
+            // Split into the nine fields; malformed lines are ignored.
+            std::vector<U8String> fields;
+            size_t start = 0;
+            size_t pos;
+            while (fields.size() < 8 && (pos = line.find('\t', start)) != U8String::npos)
+            {
+                fields.push_back(line.substr(start, pos - start));
+                start = pos + 1;
+            }
+            fields.push_back(line.substr(start));
+            if (fields.size() != 9)
+            {
+                continue;
+            }
+
+            try
+            {
+                Entry entry;
+                entry.inputHash = std::stoull(fields[0], NULL, 16);
+                entry.inputSize = std::stoull(fields[1]);
+                entry.inputModified = std::stoll(fields[2]);
+                entry.optionsHash = std::stoull(fields[3], NULL, 16);
+                entry.outputHash = std::stoull(fields[4], NULL, 16);
+                entry.outputSize = std::stoull(fields[5]);
+                entry.outputModified = std::stoll(fields[6]);
+
+                // Later entries for the same job supersede earlier ones.
+                m_done[JobKey(fields[8], fields[7])] = entry;
+            }
+            catch (std::exception &)
+            {
+                continue;
+            }
+        }
+    }
+
+    FILE                                 *m_file;
+    size_t                                m_pending;
+    bool                                  m_tornLine;
+    bool                                  m_closing;
+    std::chrono::steady_clock::time_point m_groupStart;
+    std::map<JobKey, Entry>               m_done;
+    std::mutex                            m_mutex;
+    std::condition_variable               m_wake;
+    std::thread                           m_syncThread;
+};
+
+// Returns true if the job was completed by an earlier run and its output
+// is still intact.  Files whose size and modification time match the
+// journal are accepted without being read, so resuming costs little for
+// the jobs already done; a file is only re-hashed if its time differs.
+// Outputs are synced to disk before they are recorded, so a matching
+// output cannot be one whose data was lost in a crash.
+static bool jobIsDone(const IJawsMakoPtr &jawsMako, const JobJournal &journal, const U8String &inputPath, uint64 optionsHash, const U8String &outputPath)
+{
+    const JobJournal::Entry *entry = journal.find(inputPath, outputPath);
+    if (!entry || entry->optionsHash != optionsHash)
+    {
+        return false;
+    }
+
+    uint64 size;
+    int64 modified;
+    uint64 hash;
+    if (!getFileInfo(outputPath, size, modified) || size != entry->outputSize)
+    {
+        return false;
+    }
+    if (modified != entry->outputModified && (!hashFile(outputPath, hash) || hash != entry->outputHash))
+    {
+        return false;
+    }
+
+    if (!getFileInfo(inputPath, size, modified) || size != entry->inputSize)
+    {
+        return false;
+    }
+    if (modified != entry->inputModified)
+    {
+        HashingInputStream *hashingStream = new HashingInputStream(createInputStream(jawsMako, inputPath));
+        IInputStreamPtr inputStream(hashingStream, true);
+        if (!inputStream->open() || !hashingStream->getHash(hash) || hash != entry->inputHash)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 static bool pushParam(const char *line, size_t len, size_t need, ParamMap &paramMap, DistillerParams &params)
 {
     if (len < need)
@@ -514,20 +1612,45 @@ int main(int argc, char *argv[])
 {
     try
     {
-        if (argc != 2)
+        // Only a single arg file supported, optionally preceded by --resume.
+        bool resume = false;
+        int argIndex = 1;
+        if (argc == 3 && ArgString(argv[1]) == RESUME_OPTION)
+        {
+            resume = true;
+            argIndex = 2;
+        }
+        else if (argc != 2)
         {
-            // Only a single arg file supported
             usage();
             return 1;
         }
 
-        std::ifstream argFile(argv[1]);
+        std::ifstream argFile(argv[argIndex]);
         if (!argFile.is_open())
         {
-            std::wcerr << L"Error opening file : " << argv[1] << std::endl;
+            std::wcerr << L"Error opening file : " << argv[argIndex] << std::endl;
             return 1;
         }
 
+        JobJournal journal;
+        ArgString journalPath = ArgString(argv[argIndex]) + JOURNAL_SUFFIX;
+        if (!journal.open(journalPath, resume))
+        {
+            if (resume)
+            {
+                std::wcerr << L"Error opening journal : " << journalPath.c_str() << std::endl;
+                return 1;
+            }
+
+            // The journal is only needed to resume, so carry on without it.
+            std::wcerr << L"Warning: cannot write journal " << journalPath.c_str() << L", completed jobs will not be recorded" << std::endl;
+        }
+        if (resume)
+        {
+            std::wcout << L"Resuming with " << journal.doneCount() << L" completed jobs in journal" << std::endl;
+        }
+
         // Create IJawsMako instance
         IJawsMakoPtr jawsMako = IJawsMako::create();
 
@@ -584,6 +1707,15 @@ int main(int argc, char *argv[])
         // The output path.
         U8String outputFilePath;
 
+        // Running hash of the option lines in effect, for recording jobs in
+        // the journal.  -o is left out as the output path is recorded anyway.
+        uint64 optionsHash = HASH_SEED;
+
+        // Whether to run the optimisation pass after distilling (-dO),
+        // and the object compression it should use (-dZ).
+        bool optimizeOutput = false;
+        U8String objectCompression = "none";
+
         // Create a distiller
         IDistillerPtr distiller = IDistiller::create(jawsMako);
 
@@ -618,6 +1750,33 @@ int main(int argc, char *argv[])
                 {
                     // Distill options
                     case 'd':
+                        if (strcmp(pline, "dO") == 0)
+                        {
+                            // Not an IDistiller parameter; handled after distilling.
+                            optimizeOutput = true;
+                            added = true;
+                            break;
+                        }
+                        if (strncmp(pline, "dZ", 2) == 0)
+                        {
+                            // Not an IDistiller parameter; used by the optimisation pass.
+                            if (strcmp(pline, "dZ") == 0 || strcmp(pline, "dZAll") == 0)
+                            {
+                                objectCompression = "all";
+                                added = true;
+                            }
+                            else if (strcmp(pline, "dZTags") == 0)
+                            {
+                                objectCompression = "tags";
+                                added = true;
+                            }
+                            else if (strcmp(pline, "dZNone") == 0)
+                            {
+                                objectCompression = "none";
+                                added = true;
+                            }
+                            break;
+                        }
                         added = processDistillOptions(pline, len, paramMap, distillerParams);
                         break;
 
@@ -656,7 +1815,13 @@ int main(int argc, char *argv[])
                 }
                 if (added)
                 {
-                    std::wcout << L"Processing argument line from file : " << argv[1] << std::endl;
+                    if (line[1] != 'o')
+                    {
+                        optionsHash = hashBytes(line, strlen(line), optionsHash);
+                        optionsHash = hashBytes("\n", 1, optionsHash);
+                    }
+
+                    std::wcout << L"Processing argument line from file : " << argv[argIndex] << std::endl;
                     std::wcout << line << std::endl << std::endl;
 
                     for (uint32 i = 0; i < fontNames.size(); i++)
@@ -679,19 +1844,49 @@ int main(int argc, char *argv[])
                     outputFilePath = inputFilePath + ".pdf";
                 }
 
+                // Skip the job if a previous run completed it.
+                JobJournal::Entry entry;
+                entry.optionsHash = optionsHash;
+                if (resume && jobIsDone(jawsMako, journal, inputFilePath, entry.optionsHash, outputFilePath))
+                {
+                    std::cout << "Skipping " << inputFilePath << ", already converted to " << outputFilePath << std::endl << std::endl;
+                    continue;
+                }
+
                 // Set the distill parameters if any
                 setDistillerParameters(distiller, distillerParams);
 
                 std::cout << "Converting " << inputFilePath << " to " << outputFilePath << std::endl;
 
-                // Distill
-                distiller->distill(IInputStream::createFromFile(jawsMako, inputFilePath), IOutputStream::createToFile(jawsMako, outputFilePath), progressMonitor);
+                // Distill, hashing the input for the journal as it is read.
+                bool haveInputInfo = getFileInfo(inputFilePath, entry.inputSize, entry.inputModified);
+                HashingInputStream *hashingStream = new HashingInputStream(createInputStream(jawsMako, inputFilePath));
+                IInputStreamPtr inputStream(hashingStream, true);
+                distiller->distill(inputStream, IOutputStream::createToFile(jawsMako, outputFilePath), progressMonitor);
+
+                if (optimizeOutput)
+                {
+                    std::wcout << std::endl;
+                    progress = 0;
+                    optimizePdf(jawsMako, outputFilePath, objectCompression, progressMonitor);
+                }
+
+                // Only record the job once its output is safely on disk, as
+                // resuming trusts an output whose size and time match.
+                if (haveInputInfo && hashingStream->getHash(entry.inputHash) &&
+                    syncToDisk(outputFilePath) &&
+                    hashFile(outputFilePath, entry.outputHash) &&
+                    getFileInfo(outputFilePath, entry.outputSize, entry.outputModified))
+                {
+                    journal.record(inputFilePath, outputFilePath, entry);
+                }
 
                 std::wcout << std::endl << std::endl;
             }
         }
 
         argFile.close();
+        journal.close();
 
     }
     catch(IError &e)